@@ -0,0 +1,379 @@
+/*
+ * Measures the read throughput and latency of the driver's sysfs attributes
+ * with an increasing number of concurrent reader threads.
+ *
+ * For meaningful results load the driver with the virtual sensor publishing
+ * at its maximum rate:
+ *   insmod dht22_driver.ko virtual_sensor=1 virtual_interval=1
+ *
+ * With -e it instead compares the driver's per-edge cost with the
+ * instrumentation static key off and on (requires root).
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SYSFS_DIR "/sys/kernel/dht22"
+#define DEBUGFS_DIR "/sys/kernel/debug/dht22"
+#define PARAM_DIR "/sys/module/dht22_driver/parameters"
+
+#define MAX_THREADS 64
+#define DEFAULT_DURATION 5 /* Seconds per run */
+#define EDGE_RUNS 11 /* edge_benchmark reads per setting, median is shown */
+
+/*
+ * Latencies are recorded in a log-linear histogram: 16 sub-buckets for each
+ * power of two nanoseconds, which bounds the error to ~6%.
+ */
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define HIST_SIZE (64 * SUB_BUCKETS)
+
+static const char * const attributes[] = {
+	"temperature",
+	"humidity"
+};
+
+#define ATTRIBUTE_COUNT (sizeof(attributes) / sizeof(attributes[0]))
+
+struct reader {
+	pthread_t thread;
+	int fds[ATTRIBUTE_COUNT];
+	uint64_t reads;
+	uint64_t errors;
+	uint64_t max_ns;
+	uint64_t hist[HIST_SIZE];
+};
+
+static volatile int running;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int hist_index(uint64_t ns)
+{
+	int msb;
+
+	if (ns < SUB_BUCKETS)
+		return ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	return (msb - SUB_BUCKET_BITS + 1) * SUB_BUCKETS +
+		((ns >> (msb - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/* Upper bound of the values stored in the given bucket */
+static uint64_t hist_value(int idx)
+{
+	int shift;
+
+	if (idx < SUB_BUCKETS)
+		return idx;
+
+	shift = idx / SUB_BUCKETS - 1;
+	return ((uint64_t)(SUB_BUCKETS + idx % SUB_BUCKETS + 1) << shift) - 1;
+}
+
+static uint64_t percentile(const uint64_t *hist, uint64_t total, double p)
+{
+	uint64_t target, seen;
+	int i;
+
+	target = (uint64_t)(total * p);
+	seen = 0;
+	for (i = 0; i < HIST_SIZE; i++) {
+		seen += hist[i];
+		if (seen > target)
+			return hist_value(i);
+	}
+
+	return hist_value(HIST_SIZE - 1);
+}
+
+static void *reader_func(void *data)
+{
+	struct reader *r = data;
+	char buf[64];
+	uint64_t start, elapsed;
+	unsigned int i;
+
+	i = 0;
+	while (running) {
+		start = now_ns();
+		if (pread(r->fds[i], buf, sizeof(buf), 0) <= 0)
+			r->errors++;
+		elapsed = now_ns() - start;
+
+		r->reads++;
+		r->hist[hist_index(elapsed)]++;
+		if (elapsed > r->max_ns)
+			r->max_ns = elapsed;
+
+		i = (i + 1) % ATTRIBUTE_COUNT;
+	}
+
+	return NULL;
+}
+
+static int open_attributes(struct reader *r)
+{
+	char path[128];
+	unsigned int i;
+
+	for (i = 0; i < ATTRIBUTE_COUNT; i++) {
+		snprintf(path, sizeof(path), SYSFS_DIR "/%s", attributes[i]);
+		r->fds[i] = open(path, O_RDONLY);
+		if (r->fds[i] < 0) {
+			fprintf(stderr, "Failed to open %s: %s\n",
+				path,
+				strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void close_attributes(struct reader *r)
+{
+	unsigned int i;
+
+	for (i = 0; i < ATTRIBUTE_COUNT; i++)
+		if (r->fds[i] >= 0)
+			close(r->fds[i]);
+}
+
+static int run(struct reader *readers, int nthreads, int duration)
+{
+	static uint64_t hist[HIST_SIZE];
+	uint64_t reads, errors, max_ns;
+	int i, j;
+
+	memset(readers, 0, sizeof(*readers) * nthreads);
+	for (i = 0; i < nthreads; i++)
+		if (open_attributes(&readers[i]))
+			return -1;
+
+	running = 1;
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&readers[i].thread,
+			NULL,
+			reader_func,
+			&readers[i]);
+
+	sleep(duration);
+	running = 0;
+
+	memset(hist, 0, sizeof(hist));
+	reads = errors = max_ns = 0;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(readers[i].thread, NULL);
+		close_attributes(&readers[i]);
+
+		reads += readers[i].reads;
+		errors += readers[i].errors;
+		if (readers[i].max_ns > max_ns)
+			max_ns = readers[i].max_ns;
+
+		for (j = 0; j < HIST_SIZE; j++)
+			hist[j] += readers[i].hist[j];
+	}
+
+	printf("%7d %12.0f %9.2f %9.2f %9.2f %9.2f %7llu\n",
+		nthreads,
+		(double)reads / duration,
+		percentile(hist, reads, 0.5) / 1000.0,
+		percentile(hist, reads, 0.99) / 1000.0,
+		percentile(hist, reads, 0.999) / 1000.0,
+		max_ns / 1000.0,
+		(unsigned long long)errors);
+
+	return 0;
+}
+
+static void print_publisher(void)
+{
+	char buf[32];
+	FILE *f;
+
+	f = fopen(PARAM_DIR "/virtual_sensor", "r");
+	if (!f || !fgets(buf, sizeof(buf), f) || buf[0] != 'Y') {
+		printf("Publisher: hardware sensor (load with virtual_sensor=1 "
+			"for maximum publish rate)\n");
+		if (f)
+			fclose(f);
+		return;
+	}
+
+	fclose(f);
+	f = fopen(PARAM_DIR "/virtual_interval", "r");
+	if (f && fgets(buf, sizeof(buf), f))
+		printf("Publisher: virtual sensor every %d ms\n", atoi(buf));
+
+	if (f)
+		fclose(f);
+}
+
+static int read_file(const char *dir, const char *name, char *buf, size_t len)
+{
+	char path[128];
+	ssize_t ret;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	ret = read(fd, buf, len - 1);
+	close(fd);
+	if (ret < 0)
+		return -1;
+
+	buf[ret] = '\0';
+	return 0;
+}
+
+static int write_sysfs(const char *name, const char *value)
+{
+	char path[128];
+	ssize_t ret;
+	int fd;
+
+	snprintf(path, sizeof(path), SYSFS_DIR "/%s", name);
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+
+	ret = write(fd, value, strlen(value));
+	close(fd);
+
+	return ret < 0 ? -1 : 0;
+}
+
+static int compare_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static int edge_benchmark(void)
+{
+	static const char * const settings[] = { "0", "1" };
+	long long baseline[EDGE_RUNS], instrumented[EDGE_RUNS];
+	char buf[128], saved[8];
+	unsigned int i, j;
+	int ret;
+
+	if (read_file(SYSFS_DIR, "instrumentation", saved, sizeof(saved))) {
+		fprintf(stderr, "Failed to read instrumentation: %s\n",
+			strerror(errno));
+		return 1;
+	}
+
+	printf("%15s %14s %17s %12s\n",
+		"instrumentation", "baseline ps", "instrumented ps",
+		"overhead ps");
+
+	for (i = 0; i < 2; i++) {
+		if (write_sysfs("instrumentation", settings[i])) {
+			fprintf(stderr, "Failed to set instrumentation: %s\n",
+				strerror(errno));
+			ret = 1;
+			goto out;
+		}
+
+		for (j = 0; j < EDGE_RUNS; j++) {
+			if (read_file(DEBUGFS_DIR, "edge_benchmark",
+					buf, sizeof(buf)) ||
+				sscanf(buf, "baseline %lld\ninstrumented %lld",
+					&baseline[j], &instrumented[j]) != 2) {
+				fprintf(stderr, "Failed to read edge_benchmark\n");
+				ret = 1;
+				goto out;
+			}
+		}
+
+		qsort(baseline, EDGE_RUNS, sizeof(long long), compare_ll);
+		qsort(instrumented, EDGE_RUNS, sizeof(long long), compare_ll);
+
+		printf("%15s %14lld %17lld %12lld\n",
+			settings[i][0] == '0' ? "off" : "on",
+			baseline[EDGE_RUNS / 2],
+			instrumented[EDGE_RUNS / 2],
+			instrumented[EDGE_RUNS / 2] - baseline[EDGE_RUNS / 2]);
+	}
+
+	ret = 0;
+out:
+	write_sysfs("instrumentation", saved);
+
+	return ret;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-t max_threads] [-d seconds] | -e\n"
+		"  -t  maximum number of reader threads, doubled from 1 "
+		"(default %d)\n"
+		"  -d  duration of each run in seconds (default %d)\n"
+		"  -e  measure the per-edge cost of the instrumentation hooks\n",
+		name,
+		MAX_THREADS,
+		DEFAULT_DURATION);
+}
+
+int main(int argc, char **argv)
+{
+	static struct reader readers[MAX_THREADS];
+	int opt, max_threads, duration, nthreads;
+
+	max_threads = MAX_THREADS;
+	duration = DEFAULT_DURATION;
+
+	while ((opt = getopt(argc, argv, "t:d:eh")) != -1) {
+		switch (opt) {
+		case 'e':
+			return edge_benchmark();
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (max_threads < 1 || max_threads > MAX_THREADS || duration < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	print_publisher();
+	printf("%7s %12s %9s %9s %9s %9s %7s\n",
+		"threads", "reads/s", "p50 us", "p99 us", "p99.9 us",
+		"max us", "errors");
+
+	for (nthreads = 1; nthreads <= max_threads; nthreads *= 2)
+		if (run(readers, nthreads, duration))
+			return 1;
+
+	return 0;
+}
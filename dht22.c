@@ -8,29 +8,99 @@
 #include <linux/ktime.h>
 #include <linux/hrtimer.h>
 #include <linux/kobject.h>
+#include <linux/string.h>
+#include <linux/fixp-arith.h>
+#include <linux/jump_label.h>
+#include <linux/sort.h>
+#include <linux/ratelimit.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include "dht22.h"
 #include "dht22_sm.h"
 
 static struct dht22_sm *sm;
-static struct timespec64 ts_prev_gpio_switch, ts_prev_reading;
+static struct timespec64 ts_prev_reading;
+static ktime_t kt_prev_gpio_switch;
 static int irq_number;
 static int processed_irq_count = 0;
 static ktime_t kt_interval, kt_retry_interval;
-static struct hrtimer timer, retry_timer;
+static struct hrtimer timer, retry_timer, probe_timer, virtual_timer;
+static struct hrtimer summary_timer;
 static struct kobject *dht22_kobj;
+static struct dentry *dht22_debugfs;
 
 static int irq_deltas[EXPECTED_IRQ_COUNT];
+static int compensated_deltas[EXPECTED_IRQ_COUNT];
 static int sensor_data[DATA_SIZE];
+static int compensated_data[DATA_SIZE];
+static struct dht22_stats stats, summary_prev_stats;
+
+/* Shared by all error messages to bound the total logging rate */
+static DEFINE_RATELIMIT_STATE(error_ratelimit,
+			ERROR_RATELIMIT_INTERVAL * HZ,
+			ERROR_RATELIMIT_BURST);
+
+/*
+ * capture_sample is filled in while the sensor is being read; each work
+ * then completes its own copy. last_sample is what consumers see and is
+ * only accessed under sample_lock. schedule_lock hands the time a work was
+ * queued over to the work.
+ */
+static struct dht22_sample capture_sample, last_sample;
+static ktime_t kt_trigger_scheduled, kt_virtual_scheduled;
+static DEFINE_SPINLOCK(schedule_lock);
+static DEFINE_SEQLOCK(sample_lock);
+static unsigned int latency_hist[COUNT_STAGES][LATENCY_BUCKETS];
+
+/*
+ * Gates all optional instrumentation (stage timestamps and latency
+ * histograms). When disabled the hooks are patched out to a nop.
+ */
+static DEFINE_STATIC_KEY_FALSE(instrumentation_key);
 
-static int raw_temperature = 0;
-static int raw_humidity = 0;
 static int retry_count = 0;
 static bool retry = false;
 
+static enum dht22_model model = MODEL_UNKNOWN;
+static bool sensor_online = true;
+static int absent_count = 0;
+
+static const char * const model_names[COUNT_MODELS] = {
+	"unknown",
+	"dht11",
+	"dht22",
+	"virtual"
+};
+
+static enum dht22_waveform waveform = WAVEFORM_SINE;
+static ktime_t kt_virtual_interval;
+static unsigned int virtual_sample_count = 0;
+
+static const char * const waveform_names[COUNT_WAVEFORMS] = {
+	"constant",
+	"sine",
+	"triangle",
+	"square",
+	"sawtooth"
+};
+
+static const char * const stage_names[COUNT_STAGES] = {
+	"scheduled",
+	"started",
+	"released",
+	"first_edge",
+	"last_edge",
+	"decoded",
+	"published"
+};
+
 static DECLARE_WORK(trigger_work, trigger_sensor);
 static DECLARE_WORK(work, process_results);
 static DECLARE_WORK(cleanup_work, cleanup_func);
+static DECLARE_WORK(virtual_work, generate_sample);
 
 static int gpio = GPIO_DEFAULT;
 module_param(gpio, int, S_IRUGO);
@@ -46,6 +116,36 @@ module_param(autoupdate_timeout, int, S_IRUGO);
 MODULE_PARM_DESC(autoupdate_timeout,
 	"Interval between trigger events (default: 2s, min: 2s, max: 10 min)");
 
+static bool virtual_sensor = false;
+module_param(virtual_sensor, bool, S_IRUGO);
+MODULE_PARM_DESC(virtual_sensor,
+	"Generate synthetic samples instead of using GPIO (default = false)");
+
+static char *virtual_waveform = "sine";
+module_param(virtual_waveform, charp, S_IRUGO);
+MODULE_PARM_DESC(virtual_waveform,
+	"Virtual sensor waveform: constant, sine, triangle, square, sawtooth");
+
+static int virtual_interval = VIRTUAL_INTERVAL_DEFAULT;
+module_param(virtual_interval, int, S_IRUGO);
+MODULE_PARM_DESC(virtual_interval,
+	"Interval between virtual samples (default: 100ms, min: 1ms)");
+
+static bool latency_compensation = true;
+module_param(latency_compensation, bool, S_IRUGO);
+MODULE_PARM_DESC(latency_compensation,
+	"Retry failed frames with IRQ latency compensation (default = true)");
+
+static int summary_interval = SUMMARY_INTERVAL_DEFAULT;
+module_param(summary_interval, int, S_IRUGO);
+MODULE_PARM_DESC(summary_interval,
+	"Interval between health summaries (default: 10 min, 0: disabled)");
+
+static bool instrumentation = false;
+module_param(instrumentation, bool, S_IRUGO);
+MODULE_PARM_DESC(instrumentation,
+	"Record stage timestamps and latency histograms (default = false)");
+
 static struct kobj_attribute gpio_attr = __ATTR_RO(gpio_number);
 static struct kobj_attribute autoupdate_attr =
 	__ATTR_RW(autoupdate);
@@ -53,6 +153,19 @@ static struct kobj_attribute autoupdate_timeout_attr =
 	__ATTR_RW(autoupdate_timeout_ms);
 static struct kobj_attribute temperature_attr = __ATTR_RO(temperature);
 static struct kobj_attribute humidity_attr = __ATTR_RO(humidity);
+static struct kobj_attribute reading_attr = __ATTR_RO(reading);
+static struct kobj_attribute model_attr = __ATTR_RO(model);
+static struct kobj_attribute online_attr = __ATTR_RO(online);
+static struct kobj_attribute timestamps_attr = __ATTR_RO(timestamps);
+static struct kobj_attribute latency_histogram_attr =
+	__ATTR_RO(latency_histogram);
+static struct kobj_attribute recovered_frames_attr =
+	__ATTR_RO(recovered_frames);
+static struct kobj_attribute statistics_attr = __ATTR_RO(statistics);
+static struct kobj_attribute summary_interval_attr =
+	__ATTR_RW(summary_interval_s);
+static struct kobj_attribute instrumentation_attr =
+	__ATTR_RW(instrumentation);
 static struct kobj_attribute trigger_attr = __ATTR_WO(trigger);
 
 static struct attribute *dht22_attrs[] = {
@@ -61,6 +174,15 @@ static struct attribute *dht22_attrs[] = {
 	&autoupdate_timeout_attr.attr,
 	&temperature_attr.attr,
 	&humidity_attr.attr,
+	&reading_attr.attr,
+	&model_attr.attr,
+	&online_attr.attr,
+	&timestamps_attr.attr,
+	&latency_histogram_attr.attr,
+	&recovered_frames_attr.attr,
+	&statistics_attr.attr,
+	&summary_interval_attr.attr,
+	&instrumentation_attr.attr,
 	&trigger_attr.attr,
 	NULL,
 };
@@ -76,20 +198,28 @@ static int __init dht22_init(void)
 	pr_info("DHT22 module loading...\n");
 	ret = 0;
 
+	if (virtual_sensor) {
+		ret = verify_virtual_params();
+		if (ret)
+			goto out;
+	}
+
 	sm = create_sm(&work, &cleanup_work, system_highpri_wq);
 	if (IS_ERR(sm)) {
 		ret = PTR_ERR(sm);
 		goto out;
 	}
 
-	ret = setup_dht22_gpio(gpio);
-	if (ret)
-		goto gpio_err;
+	if (!virtual_sensor) {
+		ret = setup_dht22_gpio(gpio);
+		if (ret)
+			goto gpio_err;
 
-	ktime_get_real_ts64(&ts_prev_gpio_switch);
-	ret = setup_dht22_irq(gpio);
-	if (ret)
-		goto irq_err;
+		kt_prev_gpio_switch = ktime_get();
+		ret = setup_dht22_irq(gpio);
+		if (ret)
+			goto irq_err;
+	}
 
 	dht22_kobj = kobject_create_and_add("dht22", kernel_kobj);
 	if (!dht22_kobj) {
@@ -104,9 +234,43 @@ static int __init dht22_init(void)
 		goto sysfs_err;
 	}
 
+	dht22_debugfs = debugfs_create_dir("dht22", NULL);
+	debugfs_create_file("edge_benchmark",
+			0400,
+			dht22_debugfs,
+			NULL,
+			&edge_benchmark_fops);
+
 	verify_timeout();
+	verify_summary_interval();
 	reset_data();
 
+	hrtimer_init(&summary_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	summary_timer.function = summary_timer_func;
+	if (summary_interval)
+		hrtimer_start(&summary_timer,
+			ktime_set(summary_interval, 0),
+			HRTIMER_MODE_REL);
+
+	if (instrumentation)
+		static_branch_enable(&instrumentation_key);
+
+	if (virtual_sensor) {
+		model = MODEL_VIRTUAL;
+		setup_dht22_timer(&virtual_timer,
+				kt_virtual_interval,
+				virtual_timer_func);
+
+		pr_info("Virtual sensor: %s waveform every %d ms\n",
+			waveform_names[waveform],
+			virtual_interval);
+		pr_info("DHT22 module finished loading.\n");
+		goto out;
+	}
+
+	hrtimer_init(&probe_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	probe_timer.function = probe_timer_func;
+
 	kt_retry_interval = ktime_set(RETRY_TIMEOUT, 0);
 	setup_dht22_timer(&retry_timer, kt_retry_interval, retry_timer_func);
 	setup_dht22_timer(&timer, ktime_set(0, 100 * NSEC_PER_USEC), timer_func);
@@ -117,10 +281,13 @@ static int __init dht22_init(void)
 sysfs_err:
 	kobject_put(dht22_kobj);
 kobject_err:
-	free_irq(gpio, NULL);
+	if (!virtual_sensor)
+		free_irq(gpio, NULL);
 irq_err:
-	gpio_unexport(gpio);
-	gpio_free(gpio);
+	if (!virtual_sensor) {
+		gpio_unexport(gpio);
+		gpio_free(gpio);
+	}
 gpio_err:
 	destroy_sm(sm);
 out:
@@ -129,15 +296,40 @@ out:
 
 static void __exit dht22_exit(void)
 {
-	hrtimer_cancel(&timer);
-	hrtimer_cancel(&retry_timer);
-	cancel_work_sync(&trigger_work);
+	/*
+	 * Attribute writes can re-arm the timers and queue the works, so the
+	 * attributes are removed before any of them is cancelled.
+	 */
+	kobject_put(dht22_kobj);
+	debugfs_remove_recursive(dht22_debugfs);
+
+	hrtimer_cancel(&summary_timer);
+
+	if (virtual_sensor) {
+		hrtimer_cancel(&virtual_timer);
+		cancel_work_sync(&virtual_work);
+	} else {
+		hrtimer_cancel(&timer);
+		hrtimer_cancel(&retry_timer);
+
+		/* A running trigger re-arms probe_timer and retry_timer */
+		cancel_work_sync(&trigger_work);
+		hrtimer_cancel(&probe_timer);
+
+		/* The probe callback can restart timer */
+		hrtimer_cancel(&timer);
+		hrtimer_cancel(&retry_timer);
+	}
+
 	cancel_work_sync(&work);
 	cancel_work_sync(&cleanup_work);
-	kobject_put(dht22_kobj);
-	free_irq(irq_number, NULL);
-	gpio_unexport(gpio);
-	gpio_free(gpio);
+
+	if (!virtual_sensor) {
+		free_irq(irq_number, NULL);
+		gpio_unexport(gpio);
+		gpio_free(gpio);
+	}
+
 	destroy_sm(sm);
 
 	pr_info("DHT22 module unloaded\n");
@@ -192,6 +384,29 @@ static int setup_dht22_irq(int gpio)
 	return ret;
 }
 
+static int verify_virtual_params(void)
+{
+	int ret;
+
+	ret = match_string(waveform_names, COUNT_WAVEFORMS, virtual_waveform);
+	if (ret < 0) {
+		pr_err("Unknown waveform '%s'. Exiting.\n", virtual_waveform);
+		return ret;
+	}
+
+	waveform = ret;
+
+	if (virtual_interval < VIRTUAL_INTERVAL_MIN)
+		virtual_interval = VIRTUAL_INTERVAL_MIN;
+
+	if (virtual_interval > AUTOUPDATE_TIMEOUT_MAX)
+		virtual_interval = AUTOUPDATE_TIMEOUT_MAX;
+
+	kt_virtual_interval = ms_to_ktime(virtual_interval);
+
+	return 0;
+}
+
 static void verify_timeout(void)
 {
 	if (autoupdate_timeout < AUTOUPDATE_TIMEOUT_MIN)
@@ -201,6 +416,15 @@ static void verify_timeout(void)
 		autoupdate_timeout = AUTOUPDATE_TIMEOUT_MAX;
 }
 
+static void verify_summary_interval(void)
+{
+	if (summary_interval < 0)
+		summary_interval = 0;
+
+	if (summary_interval > SUMMARY_INTERVAL_MAX)
+		summary_interval = SUMMARY_INTERVAL_MAX;
+}
+
 static void reset_data(void)
 {
 	int i;
@@ -214,6 +438,81 @@ static void reset_data(void)
 	processed_irq_count = 0;
 }
 
+/*
+ * Queues the work of a new sample and records when it was queued. If the
+ * work is already pending, the earlier time is kept so the queueing delay
+ * is not hidden. This happens once per sample, so it is not gated; the
+ * scheduled and published stages feed the mean latency.
+ */
+static void queue_sample_work(struct work_struct *work, ktime_t *scheduled)
+{
+	unsigned long flags;
+	ktime_t now;
+
+	spin_lock_irqsave(&schedule_lock, flags);
+	now = ktime_get();
+	if (queue_work(system_highpri_wq, work))
+		*scheduled = now;
+	spin_unlock_irqrestore(&schedule_lock, flags);
+}
+
+/* Called by the sample's work when it starts running */
+static void start_sample(struct dht22_sample *sample, const ktime_t *scheduled)
+{
+	unsigned long flags;
+
+	memset(sample, 0, sizeof(*sample));
+
+	spin_lock_irqsave(&schedule_lock, flags);
+	sample->timestamps[STAGE_SCHEDULED] = *scheduled;
+	spin_unlock_irqrestore(&schedule_lock, flags);
+}
+
+static inline void
+record_stage(struct dht22_sample *sample, enum dht22_stage stage)
+{
+	if (static_branch_unlikely(&instrumentation_key))
+		sample->timestamps[stage] = ktime_get();
+}
+
+/* Called for each edge with its index, before it is counted */
+static __always_inline void
+instrument_edge(struct dht22_sample *sample, int idx, ktime_t now)
+{
+	if (!static_branch_unlikely(&instrumentation_key))
+		return;
+
+	/* The edges before this one are caused by the start signal */
+	if (idx == TRIGGER_IRQ_COUNT - 1)
+		sample->timestamps[STAGE_FIRST_EDGE] = now;
+	else if (idx == EXPECTED_IRQ_COUNT - 1)
+		sample->timestamps[STAGE_LAST_EDGE] = now;
+}
+
+/*
+ * Per-edge bookkeeping of the IRQ handler, shared with the edge benchmark.
+ * hooks is always a constant; false leaves out the instrumentation hook
+ * altogether, which gives the benchmark its baseline.
+ */
+static __always_inline void
+record_edge(int *deltas,
+	int *count,
+	ktime_t *prev,
+	struct dht22_sample *sample,
+	bool hooks)
+{
+	ktime_t now;
+
+	now = ktime_get();
+	deltas[*count] = (int)ktime_us_delta(now, *prev);
+
+	if (hooks)
+		instrument_edge(sample, *count, now);
+
+	(*count)++;
+	*prev = now;
+}
+
 static void setup_dht22_timer(struct hrtimer *hres_timer,
 			ktime_t delay,
 			enum hrtimer_restart (*func)(struct hrtimer *hrtimer))
@@ -230,7 +529,18 @@ static void trigger_sensor(struct work_struct *work)
 	 * - prepare (wait some time while line is HIGH): 100-250 ms
 	 * - send start signal (pull line LOW): at least 1 ms, 10 ms LOW
 	 * - end start signal (stop pulling LOW): 40 us HIGH
+	 *
+	 * Until the model is known the longer DHT11 start signal is used;
+	 * the DHT22 accepts it as well.
 	 */
+	int signal_len;
+
+	start_sample(&capture_sample, &kt_trigger_scheduled);
+	record_stage(&capture_sample, STAGE_STARTED);
+	signal_len = (model == MODEL_DHT22 ?
+		TRIGGER_SIGNAL_LEN :
+		DHT11_TRIGGER_SIGNAL_LEN);
+
 	sm->triggered = true;
 	sm->change_state(sm);
 	ktime_get_real_ts64(&ts_prev_reading);
@@ -238,12 +548,17 @@ static void trigger_sensor(struct work_struct *work)
 	mdelay(TRIGGER_DELAY);
 
 	gpio_direction_output(gpio, LOW);
-	mdelay(TRIGGER_SIGNAL_LEN);
+	mdelay(signal_len);
 
 	gpio_direction_input(gpio);
+	record_stage(&capture_sample, STAGE_RELEASED);
 	udelay(TRIGGER_POST_DELAY);
 
-	if (!autoupdate && !hrtimer_active(&retry_timer)) {
+	hrtimer_start(&probe_timer,
+		ktime_set(0, PROBE_RESPONSE_TIMEOUT * NSEC_PER_USEC),
+		HRTIMER_MODE_REL);
+
+	if (!autoupdate && sensor_online && !hrtimer_active(&retry_timer)) {
 		retry = true;
 		hrtimer_forward_now(&retry_timer, kt_retry_interval);
 		hrtimer_restart(&retry_timer);
@@ -264,14 +579,19 @@ static enum hrtimer_restart timer_func(struct hrtimer *hrtimer)
 	 */
 	ktime_t delay;
 
-	kt_interval = ktime_set(autoupdate_timeout / MSEC_PER_SEC,
+	if (sensor_online)
+		kt_interval = ktime_set(autoupdate_timeout / MSEC_PER_SEC,
 			(autoupdate_timeout % MSEC_PER_SEC) * NSEC_PER_USEC);
+	else
+		kt_interval = ktime_set(OFFLINE_REPROBE_TIMEOUT, 0);
 
 	delay = ktime_set(0, 0);
 	if (processed_irq_count) {
-		pr_err("Resetting. Processed %d IRQs (expected %d)\n",
-			processed_irq_count,
-			EXPECTED_IRQ_COUNT);
+		stats.missed_irqs++;
+		if (__ratelimit(&error_ratelimit))
+			pr_err("Resetting. Processed %d IRQs (expected %d)\n",
+				processed_irq_count,
+				EXPECTED_IRQ_COUNT);
 
 		cleanup_func(NULL);
 
@@ -282,23 +602,32 @@ static enum hrtimer_restart timer_func(struct hrtimer *hrtimer)
 		delay = ktime_set(1, 0);
 	}
 
-	queue_work(system_highpri_wq, &trigger_work);
+	queue_sample_work(&trigger_work, &kt_trigger_scheduled);
 	hrtimer_forward_now(hrtimer, ktime_add(kt_interval, delay));
 
-	return (autoupdate ? HRTIMER_RESTART : HRTIMER_NORESTART);
+	return (autoupdate || !sensor_online ?
+		HRTIMER_RESTART :
+		HRTIMER_NORESTART);
 }
 
 static enum hrtimer_restart retry_timer_func(struct hrtimer *hrtimer)
 {
-	if (!autoupdate && retry && retry_count < MAX_RETRY_COUNT) {
+	/* The previous reading started but never completed */
+	if (retry && processed_irq_count)
+		stats.missed_irqs++;
+
+	if (!autoupdate && retry && sensor_online &&
+			retry_count < MAX_RETRY_COUNT) {
 		retry_count++;
-		pr_err("Failed to read sensor. Retrying (attempt %d of %d)\n",
-			retry_count,
-			MAX_RETRY_COUNT);
+		stats.retries++;
+		if (__ratelimit(&error_ratelimit))
+			pr_err("Failed to read sensor. Retrying (attempt %d of %d)\n",
+				retry_count,
+				MAX_RETRY_COUNT);
 
 		cleanup_func(NULL);
-		queue_work(system_highpri_wq, &trigger_work);
-	} else if (retry_count) {
+		queue_sample_work(&trigger_work, &kt_trigger_scheduled);
+	} else if (retry_count || !sensor_online) {
 		retry_count = 0;
 		retry = false;
 	}
@@ -308,25 +637,186 @@ static enum hrtimer_restart retry_timer_func(struct hrtimer *hrtimer)
 	return (retry ? HRTIMER_RESTART : HRTIMER_NORESTART);
 }
 
-static irqreturn_t dht22_irq_handler(int irq, void *data)
+static enum hrtimer_restart probe_timer_func(struct hrtimer *hrtimer)
+{
+	/*
+	 * By now the sensor must have sent its preamble. Without a sensor
+	 * on the line only the edges of the start signal are seen. Only the
+	 * edges are counted: a preamble made irregular by a late IRQ still
+	 * shows the sensor is there, and the frame is left to decoding and
+	 * retries.
+	 */
+	if (processed_irq_count < TRIGGER_IRQ_COUNT + INIT_RESPONSE_IRQ_COUNT) {
+		handle_missing_response();
+		return HRTIMER_NORESTART;
+	}
+
+	absent_count = 0;
+	if (!sensor_online) {
+		sensor_online = true;
+		pr_info("Sensor on GPIO %d is back online\n", gpio);
+	}
+
+	return HRTIMER_NORESTART;
+}
+
+static void handle_missing_response(void)
 {
-	struct timespec64 ts_current_irq, ts_diff;
+	int max_absent;
 
+	/* No frame is arriving, so the start signal edges can be dropped */
+	cleanup_func(NULL);
+	absent_count++;
+	stats.no_responses++;
+
+	/*
+	 * A line which never responded is most likely misconfigured, so it
+	 * is taken offline after a few probes, enough for a sensor to finish
+	 * powering up. A sensor which has responded before is given the
+	 * usual number of retries.
+	 */
+	max_absent = (model == MODEL_UNKNOWN ?
+		UNKNOWN_MAX_ABSENT :
+		MAX_RETRY_COUNT);
+	if (!sensor_online || absent_count < max_absent)
+		return;
+
+	sensor_online = false;
+	pr_warn("No sensor response on GPIO %d. Probing every %d s\n",
+		gpio,
+		OFFLINE_REPROBE_TIMEOUT);
+
+	if (!hrtimer_active(&timer))
+		hrtimer_start(&timer,
+			ktime_set(OFFLINE_REPROBE_TIMEOUT, 0),
+			HRTIMER_MODE_REL);
+}
+
+static enum dht22_model detect_model(void)
+{
+	if (sensor_data[0] > DHT22_HUMIDITY_MSB_MAX)
+		return MODEL_DHT11;
+
+	return MODEL_DHT22;
+}
+
+static enum hrtimer_restart virtual_timer_func(struct hrtimer *hrtimer)
+{
+	queue_sample_work(&virtual_work, &kt_virtual_scheduled);
+	hrtimer_forward_now(hrtimer, kt_virtual_interval);
+
+	return HRTIMER_RESTART;
+}
+
+static void generate_sample(struct work_struct *work)
+{
+	struct dht22_sample sample;
+	int level;
+
+	start_sample(&sample, &kt_virtual_scheduled);
+
+	level = waveform_level(virtual_sample_count % VIRTUAL_PERIOD_SAMPLES);
+	virtual_sample_count++;
+	record_stage(&sample, STAGE_DECODED);
+
+	publish_reading(&sample,
+		VIRTUAL_TEMPERATURE_BASE +
+			level * VIRTUAL_TEMPERATURE_AMPLITUDE / VIRTUAL_LEVEL_MAX,
+		VIRTUAL_HUMIDITY_BASE +
+			level * VIRTUAL_HUMIDITY_AMPLITUDE / VIRTUAL_LEVEL_MAX);
+}
+
+/*
+ * Returns the waveform value at the given phase (0 to
+ * VIRTUAL_PERIOD_SAMPLES - 1), scaled to +/- VIRTUAL_LEVEL_MAX.
+ */
+static int waveform_level(int phase)
+{
+	const int period = VIRTUAL_PERIOD_SAMPLES;
+	const int max = VIRTUAL_LEVEL_MAX;
+
+	switch (waveform) {
+	case WAVEFORM_SINE:
+		return (int)(((s64)fixp_sin32(phase * 360 / period) * max) >> 31);
+	case WAVEFORM_TRIANGLE:
+		if (phase < period / 2)
+			return -max + 4 * max * phase / period;
+
+		return 3 * max - 4 * max * phase / period;
+	case WAVEFORM_SQUARE:
+		return (phase < period / 2 ? max : -max);
+	case WAVEFORM_SAWTOOTH:
+		return -max + 2 * max * phase / period;
+	default:
+		return 0;
+	}
+}
+
+static enum hrtimer_restart summary_timer_func(struct hrtimer *hrtimer)
+{
+	if (!summary_interval)
+		return HRTIMER_NORESTART;
+
+	print_summary();
+	hrtimer_forward_now(hrtimer, ktime_set(summary_interval, 0));
+
+	return HRTIMER_RESTART;
+}
+
+/* Logs the counters accumulated since the previous summary */
+static void print_summary(void)
+{
+	struct dht22_stats now, diff;
+
+	read_stats(&now);
+	diff.samples = now.samples - summary_prev_stats.samples;
+	diff.hash_mismatches = now.hash_mismatches -
+		summary_prev_stats.hash_mismatches;
+	diff.missed_irqs = now.missed_irqs - summary_prev_stats.missed_irqs;
+	diff.spurious_irqs = now.spurious_irqs -
+		summary_prev_stats.spurious_irqs;
+	diff.no_responses = now.no_responses - summary_prev_stats.no_responses;
+	diff.retries = now.retries - summary_prev_stats.retries;
+	diff.recovered_frames = now.recovered_frames -
+		summary_prev_stats.recovered_frames;
+	diff.latency_sum_us = now.latency_sum_us -
+		summary_prev_stats.latency_sum_us;
+	diff.latency_count = now.latency_count -
+		summary_prev_stats.latency_count;
+	summary_prev_stats = now;
+
+	pr_info("dht22 gpio%d: model=%s samples=%u hash_mismatch=%u "
+		"missed_irq=%u spurious_irq=%u no_response=%u retries=%u "
+		"recovered=%u mean_latency_us=%llu online=%d\n",
+		gpio,
+		model_names[model],
+		diff.samples,
+		diff.hash_mismatches,
+		diff.missed_irqs,
+		diff.spurious_irqs,
+		diff.no_responses,
+		diff.retries,
+		diff.recovered_frames,
+		diff.latency_count ?
+			div_u64(diff.latency_sum_us, diff.latency_count) : 0,
+		sensor_online);
+}
+
+static irqreturn_t dht22_irq_handler(int irq, void *data)
+{
 	if (!sm->triggered || processed_irq_count >= EXPECTED_IRQ_COUNT) {
+		stats.spurious_irqs++;
 		sm->error = true;
 		sm->change_state(sm);
 		queue_work(system_highpri_wq, sm->cleanup_work);
 		return IRQ_HANDLED;
 	}
 
-	ktime_get_real_ts64(&ts_current_irq);
-	ts_diff = timespec64_sub(ts_current_irq, ts_prev_gpio_switch);
-
-	irq_deltas[processed_irq_count] =
-		(int)(ts_diff.tv_nsec / NSEC_PER_USEC);
-
-	processed_irq_count++;
-	ts_prev_gpio_switch = ts_current_irq;
+	record_edge(irq_deltas,
+		&processed_irq_count,
+		&kt_prev_gpio_switch,
+		&capture_sample,
+		true);
 
 	if (processed_irq_count == EXPECTED_IRQ_COUNT) {
 		sm->finished = true;
@@ -343,10 +833,13 @@ static void cleanup_func(struct work_struct *work)
 	sm->reset(sm);
 }
 
-static void process_data(void)
+static void process_data(const int *deltas, int *data)
 {
 	int i, bit_value, current_byte, current_bit, start_idx;
 
+	for (i = 0; i < DATA_SIZE; i++)
+		data[i] = 0;
+
 	/*
 	 * Skip the triggering and initial response irq deltas and process
 	 * the data irq deltas (2 for each bit, a start signal and the value).
@@ -354,27 +847,95 @@ static void process_data(void)
 	 */
 	start_idx = TRIGGER_IRQ_COUNT + INIT_RESPONSE_IRQ_COUNT;
 	for (i = start_idx; i < start_idx + DATA_IRQ_COUNT; i += 2) {
-		bit_value = irq_deltas[i + 1] > PREP_SIGNAL_LEN;
+		bit_value = deltas[i + 1] > PREP_SIGNAL_LEN;
 		current_byte = (i - start_idx) / (BITS_PER_BYTE * 2);
 		current_bit = 7 - (((i - start_idx) % (BITS_PER_BYTE * 2)) / 2);
-		sensor_data[current_byte] |= bit_value << current_bit;
+		data[current_byte] |= bit_value << current_bit;
 	}
 }
 
+static bool verify_hash(const int *data)
+{
+	int hash;
+
+	hash = data[0] + data[1] + data[2] + data[3];
+	hash &= 0xFF;
+
+	return hash == data[4];
+}
+
+/*
+ * A late IRQ makes the pulse before it look longer and the pulse after it
+ * shorter by the same amount. Each bit starts with a LOW signal of fixed
+ * length, so any deviation from it is attributed to a late edge and moved
+ * to the adjacent HIGH (value) signal:
+ * - a longer LOW means its closing edge was late, shortening the HIGH after it
+ * - a shorter LOW means its opening edge was late, lengthening the HIGH
+ *   before it
+ * The nominal LOW length is the median of the frame's LOW signals, which
+ * absorbs differences between sensors.
+ */
+static void compensate_latency(int *deltas)
+{
+	int preps[DATA_SIZE * BITS_PER_BYTE];
+	int i, bit, start_idx, nominal, excess;
+
+	start_idx = TRIGGER_IRQ_COUNT + INIT_RESPONSE_IRQ_COUNT;
+	for (bit = 0; bit < DATA_SIZE * BITS_PER_BYTE; bit++)
+		preps[bit] = deltas[start_idx + 2 * bit];
+
+	sort(preps, ARRAY_SIZE(preps), sizeof(int), compare_deltas, NULL);
+	nominal = preps[ARRAY_SIZE(preps) / 2];
+
+	for (bit = 0; bit < DATA_SIZE * BITS_PER_BYTE; bit++) {
+		i = start_idx + 2 * bit;
+		excess = deltas[i] - nominal;
+
+		if (excess > 0)
+			deltas[i + 1] += excess;
+		else if (excess < 0 && bit > 0)
+			deltas[i - 1] += excess;
+
+		deltas[i] = nominal;
+	}
+}
+
+static int compare_deltas(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
 static void process_results(struct work_struct *work)
 {
-	int hash, temperature, humidity;
+	struct dht22_sample sample;
+	int temperature, humidity;
 
-	process_data();
+	sample = capture_sample;
+	process_data(irq_deltas, sensor_data);
 
-	hash = sensor_data[0] +
-		sensor_data[1] +
-		sensor_data[2] +
-		sensor_data[3];
-	hash &= 0xFF;
+	/*
+	 * Only frames rejected by plain decoding are compensated, so a
+	 * mistaken estimate can never corrupt a frame which was fine. The
+	 * plain decode is kept unless compensation yields a valid frame, so
+	 * errors report what the sensor sent.
+	 */
+	if (!verify_hash(sensor_data) && latency_compensation) {
+		memcpy(compensated_deltas, irq_deltas, sizeof(irq_deltas));
+		compensate_latency(compensated_deltas);
+		process_data(compensated_deltas, compensated_data);
+
+		if (verify_hash(compensated_data)) {
+			memcpy(sensor_data,
+				compensated_data,
+				sizeof(compensated_data));
+			stats.recovered_frames++;
+		}
+	}
 
-	if (hash != sensor_data[4]) {
-		pr_err("Hash mismatch (%d, %d, %d, %d, %d)\n",
+	if (!verify_hash(sensor_data)) {
+		stats.hash_mismatches++;
+		if (__ratelimit(&error_ratelimit))
+			pr_err("Hash mismatch (%d, %d, %d, %d, %d)\n",
 				sensor_data[0],
 				sensor_data[1],
 				sensor_data[2],
@@ -385,25 +946,118 @@ static void process_results(struct work_struct *work)
 		return;
 	}
 
-	humidity = ((sensor_data[0] << BITS_PER_BYTE) | sensor_data[1]);
-	temperature = ((sensor_data[2] << BITS_PER_BYTE) | sensor_data[3]);
+	record_stage(&sample, STAGE_DECODED);
 
-	if (sensor_data[2] & 0x80)
-		temperature *= -1;
+	if (model == MODEL_UNKNOWN) {
+		model = detect_model();
+		pr_info("Detected %s on GPIO %d\n", model_names[model], gpio);
+	}
 
-	raw_humidity = humidity;
-	raw_temperature = temperature;
+	if (model == MODEL_DHT11) {
+		/* Integral and decimal parts are sent in separate bytes */
+		humidity = sensor_data[0] * 10 + sensor_data[1];
+		temperature = sensor_data[2] * 10 + (sensor_data[3] & 0x7F);
 
-	pr_info("Temperature: %d.%d C; Humidity: %d.%d%%\n",
-		temperature / 10,
-		temperature % 10,
-		humidity / 10,
-		humidity % 10);
+		if (sensor_data[3] & 0x80)
+			temperature *= -1;
+	} else {
+		humidity = ((sensor_data[0] << BITS_PER_BYTE) | sensor_data[1]);
+		temperature = ((sensor_data[2] << BITS_PER_BYTE) |
+			sensor_data[3]);
+
+		if (sensor_data[2] & 0x80)
+			temperature *= -1;
+	}
+
+	publish_reading(&sample, temperature, humidity);
 
 	retry = false;
 	cleanup_func(NULL);
 }
 
+/*
+ * Makes a reading visible to consumers. Both the GPIO sensor and the
+ * virtual sensor go through here.
+ */
+static void
+publish_reading(struct dht22_sample *sample, int temperature, int humidity)
+{
+	s64 latency;
+
+	sample->temperature = temperature;
+	sample->humidity = humidity;
+	sample->timestamps[STAGE_PUBLISHED] = ktime_get();
+
+	write_seqlock(&sample_lock);
+
+	stats.samples++;
+	latency = ktime_us_delta(sample->timestamps[STAGE_PUBLISHED],
+				sample->timestamps[STAGE_SCHEDULED]);
+	if (latency >= 0) {
+		stats.latency_sum_us += latency;
+		stats.latency_count++;
+	}
+
+	last_sample = *sample;
+	if (static_branch_unlikely(&instrumentation_key))
+		update_latency_histograms(sample);
+
+	write_sequnlock(&sample_lock);
+}
+
+/* Copies the most recent sample, never one half-way through an update */
+static void read_last_sample(struct dht22_sample *sample)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&sample_lock);
+		*sample = last_sample;
+	} while (read_seqretry(&sample_lock, seq));
+}
+
+/*
+ * Copies the statistics. latency_sum_us is 64 bit and could tear on 32 bit
+ * machines, so the copy is retried if publish_reading() updated it meanwhile.
+ */
+static void read_stats(struct dht22_stats *s)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&sample_lock);
+		*s = stats;
+	} while (read_seqretry(&sample_lock, seq));
+}
+
+/*
+ * Each recorded stage is accounted against the closest preceding recorded
+ * stage, so stages the sample skipped do not distort the histograms.
+ */
+static void update_latency_histograms(const struct dht22_sample *sample)
+{
+	int i, prev, bucket;
+	s64 latency;
+
+	prev = -1;
+	for (i = 0; i < COUNT_STAGES; i++) {
+		if (!ktime_to_ns(sample->timestamps[i]))
+			continue;
+
+		if (prev >= 0) {
+			latency = ktime_us_delta(sample->timestamps[i],
+						sample->timestamps[prev]);
+			bucket = (latency > 0 ? fls64(latency) : 0);
+			if (bucket >= LATENCY_BUCKETS)
+				bucket = LATENCY_BUCKETS - 1;
+
+			latency_hist[i][bucket]++;
+		}
+
+		prev = i;
+	}
+}
+
 static ssize_t
 gpio_number_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
 {
@@ -428,7 +1082,7 @@ autoupdate_store(struct kobject *kobj,
 
 	sscanf(buf, "%d\n", &temp);
 	autoupdate = temp;
-	if (autoupdate && !hrtimer_active(&timer))
+	if (autoupdate && !virtual_sensor && !hrtimer_active(&timer))
 		hrtimer_restart(&timer);
 
 	return count;
@@ -457,18 +1111,186 @@ autoupdate_timeout_ms_store(struct kobject *kobj,
 static ssize_t
 temperature_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
 {
+	struct dht22_sample sample;
+
+	read_last_sample(&sample);
+
 	return sprintf(buf,
 		"%d.%d\n",
-		raw_temperature / 10,
-		raw_temperature % 10);
+		sample.temperature / 10,
+		sample.temperature % 10);
 }
 
 static ssize_t
 humidity_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
 {
+	struct dht22_sample sample;
+
+	read_last_sample(&sample);
+
 	return sprintf(buf, "%d.%d%%\n",
-		raw_humidity / 10,
-		raw_humidity % 10);
+		sample.humidity / 10,
+		sample.humidity % 10);
+}
+
+/* Both values of one sample, which separate reads cannot guarantee */
+static ssize_t
+reading_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct dht22_sample sample;
+
+	read_last_sample(&sample);
+
+	return sprintf(buf, "%d.%d %d.%d%%\n",
+		sample.temperature / 10,
+		sample.temperature % 10,
+		sample.humidity / 10,
+		sample.humidity % 10);
+}
+
+static ssize_t
+model_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%s\n", model_names[model]);
+}
+
+static ssize_t
+online_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", sensor_online);
+}
+
+static ssize_t
+timestamps_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct dht22_sample sample;
+	int i;
+	ssize_t len;
+
+	read_last_sample(&sample);
+
+	len = 0;
+	for (i = 0; i < COUNT_STAGES; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s %lld\n",
+				stage_names[i],
+				ktime_to_ns(sample.timestamps[i]));
+
+	return len;
+}
+
+static ssize_t
+latency_histogram_show(struct kobject *kobj,
+		struct kobj_attribute *attr,
+		char *buf)
+{
+	int i, j;
+	ssize_t len;
+
+	len = 0;
+	for (i = 1; i < COUNT_STAGES; i++) {
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s",
+				stage_names[i]);
+
+		for (j = 0; j < LATENCY_BUCKETS; j++)
+			len += scnprintf(buf + len, PAGE_SIZE - len, " %u",
+					latency_hist[i][j]);
+
+		len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+	}
+
+	return len;
+}
+
+static ssize_t
+recovered_frames_show(struct kobject *kobj,
+		struct kobj_attribute *attr,
+		char *buf)
+{
+	return sprintf(buf, "%u\n", stats.recovered_frames);
+}
+
+static ssize_t
+statistics_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct dht22_stats now;
+
+	read_stats(&now);
+
+	return sprintf(buf,
+		"samples %u\n"
+		"hash_mismatch %u\n"
+		"missed_irq %u\n"
+		"spurious_irq %u\n"
+		"no_response %u\n"
+		"retries %u\n"
+		"recovered %u\n"
+		"mean_latency_us %llu\n",
+		now.samples,
+		now.hash_mismatches,
+		now.missed_irqs,
+		now.spurious_irqs,
+		now.no_responses,
+		now.retries,
+		now.recovered_frames,
+		now.latency_count ?
+			div_u64(now.latency_sum_us, now.latency_count) : 0);
+}
+
+static ssize_t
+summary_interval_s_show(struct kobject *kobj,
+			struct kobj_attribute *attr,
+			char *buf)
+{
+	return sprintf(buf, "%d\n", summary_interval);
+}
+
+static ssize_t
+summary_interval_s_store(struct kobject *kobj,
+			struct kobj_attribute *attr,
+			const char *buf,
+			size_t count)
+{
+	sscanf(buf, "%d\n", &summary_interval);
+	verify_summary_interval();
+
+	/* Re-arm so a shorter interval takes effect immediately */
+	hrtimer_cancel(&summary_timer);
+	if (summary_interval)
+		hrtimer_start(&summary_timer,
+			ktime_set(summary_interval, 0),
+			HRTIMER_MODE_REL);
+
+	return count;
+}
+
+static ssize_t
+instrumentation_show(struct kobject *kobj,
+		struct kobj_attribute *attr,
+		char *buf)
+{
+	return sprintf(buf, "%d\n", static_key_enabled(&instrumentation_key));
+}
+
+static ssize_t
+instrumentation_store(struct kobject *kobj,
+		struct kobj_attribute *attr,
+		const char *buf,
+		size_t count)
+{
+	bool enable;
+
+	/* This patches kernel text, so malformed input must not toggle it */
+	if (kstrtobool(buf, &enable))
+		return -EINVAL;
+
+	/* Keep the module parameter in sync with the attribute */
+	instrumentation = enable;
+	if (enable)
+		static_branch_enable(&instrumentation_key);
+	else
+		static_branch_disable(&instrumentation_key);
+
+	return count;
 }
 
 static ssize_t
@@ -482,6 +1304,14 @@ trigger_store(struct kobject *kobj,
 	bool can_trigger;
 	ktime_t prev, min_interval;
 
+	if (virtual_sensor) {
+		sscanf(buf, "%d\n", &trigger);
+		if (trigger)
+			queue_sample_work(&virtual_work, &kt_virtual_scheduled);
+
+		return count;
+	}
+
 	ktime_get_real_ts64(&now);
 	prev = timespec64_to_ktime(ts_prev_reading);
 
@@ -493,11 +1323,73 @@ trigger_store(struct kobject *kobj,
 
 	sscanf(buf, "%d\n", &trigger);
 	if (trigger && can_trigger)
-		queue_work(system_highpri_wq, &trigger_work);
+		queue_sample_work(&trigger_work, &kt_trigger_scheduled);
 
 	return count;
 }
 
+/*
+ * Runs the IRQ handler's per-edge bookkeeping on scratch data, once
+ * without the instrumentation hook and once with it, and shows the cost
+ * per edge in picoseconds. Compare the output with instrumentation on and
+ * off to measure the overhead of the hook. Root only (debugfs, 0400) since
+ * it runs with preemption disabled.
+ */
+static int edge_benchmark_show(struct seq_file *m, void *v)
+{
+	struct {
+		int deltas[EXPECTED_IRQ_COUNT];
+		int count;
+		ktime_t prev;
+		struct dht22_sample sample;
+	} scratch;
+	ktime_t start;
+	s64 baseline, instrumented;
+	int i;
+
+	memset(&scratch, 0, sizeof(scratch));
+
+	preempt_disable();
+
+	start = ktime_get();
+	for (i = 0; i < EDGE_BENCHMARK_LOOPS; i++) {
+		if (scratch.count == EXPECTED_IRQ_COUNT)
+			scratch.count = 0;
+
+		record_edge(scratch.deltas,
+			&scratch.count,
+			&scratch.prev,
+			&scratch.sample,
+			false);
+		barrier_data(&scratch);
+	}
+	baseline = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	start = ktime_get();
+	for (i = 0; i < EDGE_BENCHMARK_LOOPS; i++) {
+		if (scratch.count == EXPECTED_IRQ_COUNT)
+			scratch.count = 0;
+
+		record_edge(scratch.deltas,
+			&scratch.count,
+			&scratch.prev,
+			&scratch.sample,
+			true);
+		barrier_data(&scratch);
+	}
+	instrumented = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	preempt_enable();
+
+	seq_printf(m, "baseline %lld\ninstrumented %lld\n",
+		div_s64(baseline * 1000, EDGE_BENCHMARK_LOOPS),
+		div_s64(instrumented * 1000, EDGE_BENCHMARK_LOOPS));
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(edge_benchmark);
+
 module_init(dht22_init);
 module_exit(dht22_exit);
 
@@ -30,22 +30,164 @@
 #define TRIGGER_POST_DELAY 40
 #define PREP_SIGNAL_LEN 50
 
+/* The DHT11 needs a start signal of at least 18 ms (in ms) */
+#define DHT11_TRIGGER_SIGNAL_LEN 20
+
+/*
+ * Time after releasing the line when the response is checked (in us).
+ * The sensor acknowledges the start signal with a preamble of ~80 us LOW
+ * followed by ~80 us HIGH, so its edges have arrived by then.
+ */
+#define PROBE_RESPONSE_TIMEOUT 1000
+
+/* Interval between probes of a sensor marked offline */
+#define OFFLINE_REPROBE_TIMEOUT 60 /* Seconds */
+
+/*
+ * Failed probes before a line which never responded is marked offline. The
+ * first probe follows module load immediately, which can be before a freshly
+ * powered sensor is ready (~1 s), so the retries spaced RETRY_TIMEOUT apart
+ * give it time to come up.
+ */
+#define UNKNOWN_MAX_ABSENT 3
+
+/*
+ * The DHT22 reports humidity * 10 (max 1000), so the first byte never
+ * exceeds 3. The DHT11 reports integral humidity (20-90%) in that byte.
+ */
+#define DHT22_HUMIDITY_MSB_MAX 3
+
+enum dht22_model {
+	MODEL_UNKNOWN = 0,
+	MODEL_DHT11,
+	MODEL_DHT22,
+	MODEL_VIRTUAL,
+	COUNT_MODELS
+};
+
+/*
+ * Virtual sensor: samples are generated in software at virtual_interval ms
+ * (1 ms minimum) following a waveform with a period of
+ * VIRTUAL_PERIOD_SAMPLES samples. Values are in tenths, like real readings.
+ */
+#define VIRTUAL_INTERVAL_DEFAULT 100
+#define VIRTUAL_INTERVAL_MIN 1
+#define VIRTUAL_PERIOD_SAMPLES 60
+#define VIRTUAL_LEVEL_MAX 1000
+#define VIRTUAL_TEMPERATURE_BASE 200
+#define VIRTUAL_TEMPERATURE_AMPLITUDE 100
+#define VIRTUAL_HUMIDITY_BASE 500
+#define VIRTUAL_HUMIDITY_AMPLITUDE 300
+
+/*
+ * Pipeline stages of a sample, in order. Each sample records a monotonic
+ * timestamp per stage; the virtual sensor only records scheduled, decoded
+ * and published.
+ */
+enum dht22_stage {
+	STAGE_SCHEDULED = 0,	/* trigger work queued */
+	STAGE_STARTED,		/* trigger work running */
+	STAGE_RELEASED,		/* start signal ended, line released */
+	STAGE_FIRST_EDGE,	/* first edge driven by the sensor */
+	STAGE_LAST_EDGE,	/* last data edge */
+	STAGE_DECODED,		/* checksum verified */
+	STAGE_PUBLISHED,	/* visible to consumers */
+	COUNT_STAGES
+};
+
+/*
+ * Latency histograms have power of two buckets in us: bucket 0 counts
+ * latencies below 1 us, bucket n those below 2^n us. The last bucket
+ * collects everything above.
+ */
+#define LATENCY_BUCKETS 20
+
+/* Number of simulated edges per edge_benchmark run */
+#define EDGE_BENCHMARK_LOOPS 100000
+
+struct dht22_sample {
+	int temperature;
+	int humidity;
+	ktime_t timestamps[COUNT_STAGES];
+};
+
+/*
+ * Health reporting: a summary of the counters is logged every
+ * summary_interval seconds, errors are logged at most
+ * ERROR_RATELIMIT_BURST times per ERROR_RATELIMIT_INTERVAL.
+ */
+#define SUMMARY_INTERVAL_DEFAULT 600 /* Seconds, 0 disables the summary */
+#define SUMMARY_INTERVAL_MAX (24 * 60 * 60)
+#define ERROR_RATELIMIT_INTERVAL 60 /* Seconds */
+#define ERROR_RATELIMIT_BURST 5
+
+struct dht22_stats {
+	unsigned int samples;
+	unsigned int hash_mismatches;	/* failed hash check */
+	unsigned int missed_irqs;	/* reading never completed */
+	unsigned int spurious_irqs;	/* IRQ while not reading */
+	unsigned int no_responses;	/* no preamble from the sensor */
+	unsigned int retries;
+	unsigned int recovered_frames;	/* fixed by latency compensation */
+	u64 latency_sum_us;		/* scheduled to published */
+	unsigned int latency_count;	/* samples in latency_sum_us */
+};
+
+enum dht22_waveform {
+	WAVEFORM_CONSTANT = 0,
+	WAVEFORM_SINE,
+	WAVEFORM_TRIANGLE,
+	WAVEFORM_SQUARE,
+	WAVEFORM_SAWTOOTH,
+	COUNT_WAVEFORMS
+};
+
 static int setup_dht22_gpio(int gpio);
 static int setup_dht22_irq(int gpio);
+static int verify_virtual_params(void);
 static void verify_timeout(void);
+static void verify_summary_interval(void);
 
 static void reset_data(void);
+static void queue_sample_work(struct work_struct *work, ktime_t *scheduled);
+static void start_sample(struct dht22_sample *sample, const ktime_t *scheduled);
+static inline void
+record_stage(struct dht22_sample *sample, enum dht22_stage stage);
+static __always_inline void
+instrument_edge(struct dht22_sample *sample, int idx, ktime_t now);
+static __always_inline void
+record_edge(int *deltas,
+	int *count,
+	ktime_t *prev,
+	struct dht22_sample *sample,
+	bool hooks);
 static void setup_dht22_timer(struct hrtimer *hres_timer,
 			ktime_t delay,
 			enum hrtimer_restart (*func)(struct hrtimer *hrtimer));
 static void trigger_sensor(struct work_struct *work);
 static enum hrtimer_restart timer_func(struct hrtimer *hrtimer);
 static enum hrtimer_restart retry_timer_func(struct hrtimer *hrtimer);
+static enum hrtimer_restart probe_timer_func(struct hrtimer *hrtimer);
+static enum hrtimer_restart summary_timer_func(struct hrtimer *hrtimer);
+static void print_summary(void);
+static void handle_missing_response(void);
+static enum dht22_model detect_model(void);
+static enum hrtimer_restart virtual_timer_func(struct hrtimer *hrtimer);
+static void generate_sample(struct work_struct *work);
+static int waveform_level(int phase);
 
 static irqreturn_t dht22_irq_handler(int irq, void *data);
 static void cleanup_func(struct work_struct *work);
-static void process_data(void);
+static void process_data(const int *deltas, int *data);
+static bool verify_hash(const int *data);
+static void compensate_latency(int *deltas);
+static int compare_deltas(const void *a, const void *b);
 static void process_results(struct work_struct *work);
+static void
+publish_reading(struct dht22_sample *sample, int temperature, int humidity);
+static void read_last_sample(struct dht22_sample *sample);
+static void read_stats(struct dht22_stats *s);
+static void update_latency_histograms(const struct dht22_sample *sample);
 
 static ssize_t
 gpio_number_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
@@ -76,6 +218,56 @@ temperature_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
 static ssize_t
 humidity_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
 
+static ssize_t
+reading_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
+
+static ssize_t
+model_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
+
+static ssize_t
+online_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
+
+static ssize_t
+timestamps_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
+
+static ssize_t
+latency_histogram_show(struct kobject *kobj,
+		struct kobj_attribute *attr,
+		char *buf);
+
+static ssize_t
+recovered_frames_show(struct kobject *kobj,
+		struct kobj_attribute *attr,
+		char *buf);
+
+static ssize_t
+statistics_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
+
+static ssize_t
+summary_interval_s_show(struct kobject *kobj,
+			struct kobj_attribute *attr,
+			char *buf);
+
+static ssize_t
+summary_interval_s_store(struct kobject *kobj,
+			struct kobj_attribute *attr,
+			const char *buf,
+			size_t count);
+
+static ssize_t
+instrumentation_show(struct kobject *kobj,
+		struct kobj_attribute *attr,
+		char *buf);
+
+static ssize_t
+instrumentation_store(struct kobject *kobj,
+		struct kobj_attribute *attr,
+		const char *buf,
+		size_t count);
+
+static int edge_benchmark_show(struct seq_file *m, void *v);
+static const struct file_operations edge_benchmark_fops;
+
 static ssize_t
 trigger_store(struct kobject *kobj,
 		struct kobj_attribute *attr,